@@ -0,0 +1,16 @@
+QT = core
+CONFIG += c++17 console
+CONFIG -= app_bundle
+TARGET = predict_latency
+
+SOURCES += \
+    predict_latency.cpp \
+    ../src/xgbooster.cpp \
+    ../src/dmatrixcache.cpp
+
+HEADERS += \
+    ../src/xgbooster.hpp \
+    ../src/dmatrixcache.hpp
+
+INCLUDEPATH += ../include ../src
+LIBS += -L$$PWD/../lib -lxgboost
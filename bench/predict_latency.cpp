@@ -0,0 +1,147 @@
+// predict_latency.cpp
+// Latency harness for XGBModel::PredictOne under concurrent callers.
+//
+// Usage: predict_latency [threads] [calls_per_thread] [features]
+#include "xgbooster.hpp"
+
+#include <QCoreApplication>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+static QVector<QVector<double>> makeFeatures(int rows, int features, std::mt19937& g) {
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    QVector<QVector<double>> X(rows, QVector<double>(features));
+    for (auto& row : X)
+        for (double& v : row)
+            v = dist(g);
+    return X;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    size_t idx = static_cast<size_t>(p * (sorted.size() - 1));
+    return sorted[idx];
+}
+
+static void run(const QString& name, const XGBModel& model,
+                const std::vector<float>& rows, int threads, int calls) {
+    const int n_features = model.n_features();
+    const int n_rows = static_cast<int>(rows.size() / n_features);
+
+    std::vector<std::vector<double>> latencies(threads, std::vector<double>(calls));
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            double out = 0.0;
+            // Warm up the per-thread prediction state outside the measurement
+            model.PredictOne(rows.data(), &out);
+            ++ready;
+            while (!go.load())
+                std::this_thread::yield();
+
+            auto& lat = latencies[t];
+            for (int i = 0; i < calls; ++i) {
+                const float* row = rows.data() + size_t((i + t) % n_rows) * n_features;
+                auto start = std::chrono::steady_clock::now();
+                model.PredictOne(row, &out);
+                auto stop = std::chrono::steady_clock::now();
+                lat[i] = std::chrono::duration<double, std::micro>(stop - start).count();
+            }
+        });
+    }
+    while (ready.load() < threads)
+        std::this_thread::yield();
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto& w : workers)
+        w.join();
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> all;
+    all.reserve(size_t(threads) * calls);
+    for (const auto& lat : latencies)
+        all.insert(all.end(), lat.begin(), lat.end());
+    std::sort(all.begin(), all.end());
+
+    QTextStream out(stdout);
+    out << name << ": threads=" << threads << " calls=" << all.size()
+        << " qps=" << QString::number(all.size() / wall, 'f', 0)
+        << " p50=" << QString::number(percentile(all, 0.50), 'f', 2) << "us"
+        << " p99=" << QString::number(percentile(all, 0.99), 'f', 2) << "us"
+        << " p999=" << QString::number(percentile(all, 0.999), 'f', 2) << "us\n";
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QStringList args = app.arguments();
+    int threads = args.size() > 1 ? args[1].toInt() : int(std::thread::hardware_concurrency());
+    int calls = args.size() > 2 ? args[2].toInt() : 100000;
+    int features = args.size() > 3 ? args[3].toInt() : 20;
+    const int trainRows = 10000;
+    threads = std::max(threads, 1);
+    calls = std::max(calls, 1);
+    features = std::max(features, 2);
+
+    std::mt19937 g(42);
+    QVector<QVector<double>> X = makeFeatures(trainRows, features, g);
+    QVector<double> y_reg, y_cls;
+    for (const auto& row : X) {
+        y_reg.append(row[0] * 2.0 + row[1]);
+        y_cls.append(row[0] > 0 ? (row[1] > 0 ? 3.0 : 2.0) : 1.0);
+    }
+
+    std::vector<float> rows;
+    rows.reserve(size_t(trainRows) * features);
+    for (const auto& row : X)
+        for (double v : row)
+            rows.push_back(static_cast<float>(v));
+
+    QMap<QString, QString> params;
+    params["num_boost_round"] = "100";
+    params["max_depth"] = "6";
+    params["eta"] = "0.1";
+
+    QTemporaryDir dir;
+    if (!dir.isValid()) {
+        QTextStream(stderr) << "Cannot create temporary directory\n";
+        return 1;
+    }
+
+    // Models are trained with the default thread count. Default prediction uses
+    // OpenMP inside every call; SetPredictThreads(1) is the configuration
+    // recommended for concurrent PredictOne callers, also for loaded models.
+    XGBRegressor reg(params);
+    reg.Fit(X, y_reg);
+    run("regressor (default threads)", reg, rows, threads, calls);
+    reg.SetPredictThreads(1);
+    run("regressor (predict threads=1)", reg, rows, threads, calls);
+    reg.SaveModel(dir.filePath("reg.model"));
+
+    XGBRegressor regLoaded(params);
+    regLoaded.LoadModel(dir.filePath("reg.model"));
+    regLoaded.SetPredictThreads(1);
+    run("regressor (loaded, predict threads=1)", regLoaded, rows, threads, calls);
+
+    XGBClassifier clf(params);
+    clf.Fit(X, y_cls);
+    run("classifier (default threads)", clf, rows, threads, calls);
+    clf.SetPredictThreads(1);
+    run("classifier (predict threads=1)", clf, rows, threads, calls);
+    clf.SaveModel(dir.filePath("clf.model"));
+
+    XGBClassifier clfLoaded(params);
+    clfLoaded.LoadModel(dir.filePath("clf.model"));
+    clfLoaded.SetPredictThreads(1);
+    run("classifier (loaded, predict threads=1)", clfLoaded, rows, threads, calls);
+
+    return 0;
+}
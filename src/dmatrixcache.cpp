@@ -0,0 +1,132 @@
+#include "dmatrixcache.hpp"
+#include <QMutexLocker>
+#include <stdexcept>
+
+DMatrixPtr MakeDMatrixPtr(DMatrixHandle handle) {
+    return DMatrixPtr(handle, [](void* h) {
+        if (h) XGDMatrixFree(h);
+    });
+}
+
+DMatrixCache& DMatrixCache::instance() {
+    static DMatrixCache cache;
+    return cache;
+}
+
+qint64 DMatrixCache::EstimateBytes(size_t n_rows, size_t n_cols) {
+    // Sparse page entry (index + value) plus one byte per cell of the
+    // quantized histogram index, plus the row offsets.
+    return qint64(n_rows) * (qint64(n_cols) * 9 + qint64(sizeof(bst_ulong)));
+}
+
+// Guards against a key reused for other data: the cached matrix must have the
+// shape of the data the caller passed.
+static void CheckShape(const DMatrixPtr& matrix, size_t n_rows, size_t n_cols) {
+    bst_ulong rows = 0, cols = 0;
+    if (XGDMatrixNumRow(matrix.get(), &rows) != 0 || XGDMatrixNumCol(matrix.get(), &cols) != 0)
+        throw std::runtime_error(XGBGetLastError());
+    if (rows != n_rows || cols != n_cols)
+        throw std::invalid_argument("Cached DMatrix shape does not match the data for this key");
+}
+
+DMatrixPtr DMatrixCache::Acquire(const QString& key, size_t n_rows, size_t n_cols, const Builder& build,
+                                 std::shared_ptr<QMutex>* fitMutex) {
+    if (fitMutex)
+        fitMutex->reset();
+    if (key.isEmpty())
+        return MakeDMatrixPtr(build());
+
+    DMatrixPtr cached;
+    std::shared_ptr<QMutex> cachedMutex;
+    {
+        QMutexLocker lock(&mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            it->lastUse = ++clock_;
+            cached = it->matrix;
+            cachedMutex = it->fitMutex;
+        }
+    }
+    if (cached) {
+        CheckShape(cached, n_rows, n_cols);
+        if (fitMutex)
+            *fitMutex = cachedMutex;
+        return cached;
+    }
+
+    // Build outside the lock: constructing a large matrix may take a while.
+    DMatrixPtr matrix = MakeDMatrixPtr(build());
+
+    QMutexLocker lock(&mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        // Another thread built the same key meanwhile
+        it->lastUse = ++clock_;
+        cached = it->matrix;
+        cachedMutex = it->fitMutex;
+        lock.unlock();
+        CheckShape(cached, n_rows, n_cols);
+        if (fitMutex)
+            *fitMutex = cachedMutex;
+        return cached;
+    }
+
+    Entry entry;
+    entry.matrix = matrix;
+    entry.fitMutex = std::make_shared<QMutex>();
+    if (fitMutex)
+        *fitMutex = entry.fitMutex;
+    entry.bytes = EstimateBytes(n_rows, n_cols);
+    entry.lastUse = ++clock_;
+    entries_.insert(key, entry);
+    memoryUsage_ += entry.bytes;
+    EvictLocked(key);
+    return matrix;
+}
+
+void DMatrixCache::EvictLocked(const QString& keep) {
+    while (memoryUsage_ > memoryLimit_ && entries_.size() > 1) {
+        auto oldest = entries_.end();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it.key() == keep)
+                continue;
+            if (oldest == entries_.end() || it->lastUse < oldest->lastUse)
+                oldest = it;
+        }
+        if (oldest == entries_.end())
+            break;
+        memoryUsage_ -= oldest->bytes;
+        entries_.erase(oldest);
+    }
+}
+
+void DMatrixCache::Remove(const QString& key) {
+    QMutexLocker lock(&mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end())
+        return;
+    memoryUsage_ -= it->bytes;
+    entries_.erase(it);
+}
+
+void DMatrixCache::Clear() {
+    QMutexLocker lock(&mutex_);
+    entries_.clear();
+    memoryUsage_ = 0;
+}
+
+void DMatrixCache::SetMemoryLimit(qint64 bytes) {
+    QMutexLocker lock(&mutex_);
+    memoryLimit_ = bytes;
+    EvictLocked(QString());
+}
+
+qint64 DMatrixCache::MemoryLimit() const {
+    QMutexLocker lock(&mutex_);
+    return memoryLimit_;
+}
+
+qint64 DMatrixCache::MemoryUsage() const {
+    QMutexLocker lock(&mutex_);
+    return memoryUsage_;
+}
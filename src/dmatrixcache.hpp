@@ -0,0 +1,67 @@
+#pragma once
+
+#include <xgboost/c_api.h>
+#include <QString>
+#include <QHash>
+#include <QMutex>
+#include <functional>
+#include <memory>
+
+// Owning DMatrix handle: XGDMatrixFree is called when the last reference goes away.
+using DMatrixPtr = std::shared_ptr<void>;
+
+DMatrixPtr MakeDMatrixPtr(DMatrixHandle handle);
+
+// Process-wide cache of constructed DMatrix objects.
+//
+// XGBoost keeps the quantile sketch / histogram cuts inside the DMatrix, so
+// handing the same matrix to a new booster skips both the copy and the sketch.
+// Keys are chosen by the caller and must identify the dataset, the feature
+// selection and the rows (train/test split) the matrix was built from.
+// Least recently used entries are dropped once the estimated size exceeds the
+// memory limit; matrices still referenced by a model stay alive until released.
+//
+// Labels and weights live inside the matrix, so Fit on a shared train matrix
+// must hold the entry's fit mutex for the whole training; XGBModel does this.
+class DMatrixCache {
+public:
+    using Builder = std::function<DMatrixHandle()>;
+
+    static DMatrixCache& instance();
+
+    // Returns the cached matrix for key or builds it; an empty key bypasses the cache.
+    // Throws std::invalid_argument if the cached matrix is not n_rows x n_cols.
+    // fitMutex, if given, receives the mutex serialising Fit on this matrix
+    // (nullptr for an uncached matrix).
+    DMatrixPtr Acquire(const QString& key, size_t n_rows, size_t n_cols, const Builder& build,
+                       std::shared_ptr<QMutex>* fitMutex = nullptr);
+
+    void Remove(const QString& key);
+    void Clear();
+
+    void SetMemoryLimit(qint64 bytes);
+    qint64 MemoryLimit() const;
+    qint64 MemoryUsage() const;
+
+    static qint64 EstimateBytes(size_t n_rows, size_t n_cols);
+
+private:
+    DMatrixCache() = default;
+    DMatrixCache(const DMatrixCache&) = delete;
+    DMatrixCache& operator=(const DMatrixCache&) = delete;
+
+    struct Entry {
+        DMatrixPtr matrix;
+        std::shared_ptr<QMutex> fitMutex;
+        qint64 bytes = 0;
+        quint64 lastUse = 0;
+    };
+
+    void EvictLocked(const QString& keep);
+
+    mutable QMutex mutex_;
+    QHash<QString, Entry> entries_;
+    qint64 memoryLimit_ = qint64(2) * 1024 * 1024 * 1024;
+    qint64 memoryUsage_ = 0;
+    quint64 clock_ = 0;
+};
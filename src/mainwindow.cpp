@@ -174,6 +174,21 @@ void MainWindow::loadCSV() {
     // (We add it as a member QVector<QVector<double>> dataRows_)
 
     dataRows_ = dataRows;
+    releaseCachedSplit();
+    ++datasetId_;
+    selectionKey_.clear();
+}
+
+QString MainWindow::dataKey(const QString& part) const {
+    if (selectionKey_.isEmpty())
+        return QString();
+    return QString("%1|%2|%3").arg(selectionKey_).arg(splitId_).arg(part);
+}
+
+void MainWindow::releaseCachedSplit() {
+    DMatrixCache::instance().Remove(dataKey("train-reg"));
+    DMatrixCache::instance().Remove(dataKey("train-cls"));
+    DMatrixCache::instance().Remove(dataKey("test"));
 }
 
 // -------- Training --------
@@ -206,38 +221,51 @@ void MainWindow::startTraining() {
         return;
     }
 
-    // Shuffle indices
-    QVector<int> indices(totalRows);
-    std::iota(indices.begin(), indices.end(), 0);
-    std::random_device rd;
-    std::mt19937 g(rd());
-    std::shuffle(indices.begin(), indices.end(), g);
-
-    int trainCount = totalRows * 0.66;
-
-    features_.clear();
-    targets_.clear();
-    stabilizer_.clear();
-    features_test_.clear();
-    targets_test_.clear();
-    stabilizer_test_.clear();
-
-    for (int i = 0; i < totalRows; ++i) {
-        int row = indices[i];
-        QVector<double> featRow;
-        for (int fidx : featureIndices)
-            featRow.append(dataRows_[row][fidx]);
-        if (i < trainCount) {
-            features_.append(featRow);
-            targets_.append(dataRows_[row][targetIdx]);
-            if (stabilizerIdx >= 0)
-                stabilizer_.append(static_cast<float>(dataRows_[row][stabilizerIdx]));
-        } else {
-            features_test_.append(featRow);
-            targets_test_.append(dataRows_[row][targetIdx]);
-            if (stabilizerIdx >= 0)
-                stabilizer_test_.append(static_cast<float>(dataRows_[row][stabilizerIdx]));
+    QStringList selection;
+    for (int fidx : featureIndices)
+        selection << QString::number(fidx);
+    QString selectionKey = QString("%1|%2|%3|%4")
+        .arg(datasetId_).arg(selection.join(',')).arg(targetIdx).arg(stabilizerIdx);
+
+    if (selectionKey != selectionKey_) {
+        // Shuffle indices
+        QVector<int> indices(totalRows);
+        std::iota(indices.begin(), indices.end(), 0);
+        std::random_device rd;
+        std::mt19937 g(rd());
+        std::shuffle(indices.begin(), indices.end(), g);
+
+        int trainCount = totalRows * 0.66;
+
+        features_.clear();
+        targets_.clear();
+        stabilizer_.clear();
+        features_test_.clear();
+        targets_test_.clear();
+        stabilizer_test_.clear();
+
+        for (int i = 0; i < totalRows; ++i) {
+            int row = indices[i];
+            QVector<double> featRow;
+            for (int fidx : featureIndices)
+                featRow.append(dataRows_[row][fidx]);
+            if (i < trainCount) {
+                features_.append(featRow);
+                targets_.append(dataRows_[row][targetIdx]);
+                if (stabilizerIdx >= 0)
+                    stabilizer_.append(static_cast<float>(dataRows_[row][stabilizerIdx]));
+            } else {
+                features_test_.append(featRow);
+                targets_test_.append(dataRows_[row][targetIdx]);
+                if (stabilizerIdx >= 0)
+                    stabilizer_test_.append(static_cast<float>(dataRows_[row][stabilizerIdx]));
+            }
         }
+
+        // Previous split is not needed anymore: drop its matrices from the cache
+        releaseCachedSplit();
+        selectionKey_ = selectionKey;
+        ++splitId_;
     }
 
     // Build params map
@@ -263,12 +291,15 @@ void MainWindow::startTraining() {
     // Connect progress signal
     connect(model_, &XGBModel::progress, this, &MainWindow::updateProgress);
 
+    // Labels and weights are stored inside the train matrix, so it is cached per task
+    QString trainKey = dataKey(isRegression ? "train-reg" : "train-cls");
+
     // Train with stabilizer if classification
     if (!isRegression && !stabilizer_.isEmpty()) {
         auto *cls = dynamic_cast<XGBClassifier*>(model_);
-        cls->Fit(features_, targets_, stabilizer_, 0.0f, 1.0f);
+        cls->Fit(features_, targets_, stabilizer_, 0.0f, 1.0f, trainKey);
     } else {
-        model_->Fit(features_, targets_, 0.0f, 1.0f);
+        model_->Fit(features_, targets_, 0.0f, 1.0f, trainKey);
     }
 
     saveButton_->setEnabled(true);
@@ -312,7 +343,16 @@ void MainWindow::loadModel() {
     else
         model_ = new XGBClassifier(dummyParams, this);
 
-    model_->LoadModel(filename);
+    try {
+        model_->LoadModel(filename);
+    } catch (const std::exception& e) {
+        model_->deleteLater();
+        model_ = nullptr;
+        saveButton_->setEnabled(false);
+        predictButton_->setEnabled(false);
+        QMessageBox::warning(this, "Error", QString("Cannot load model: %1").arg(e.what()));
+        return;
+    }
     saveButton_->setEnabled(true);
     loadModelButton_->setEnabled(true);
     predictButton_->setEnabled(true);
@@ -332,7 +372,13 @@ void MainWindow::predict() {
         return;
     }
 
-    QVector<double> preds = model_->Predict(features_test_);
+    QVector<double> preds;
+    try {
+        preds = model_->Predict(features_test_, dataKey("test"));
+    } catch (const std::exception& e) {
+        QMessageBox::warning(this, "Error", QString("Prediction failed: %1").arg(e.what()));
+        return;
+    }
 
     if (preds.size() != targets_test_.size()) {
         QMessageBox::warning(this, "Error", "Prediction size mismatch");
@@ -31,6 +31,14 @@ private:
     QVector<QVector<double>> dataRows_;
     QStringList columnNames_;
 
+    // Train/test split is kept while the dataset and column selection stay the same,
+    // so retraining with other params reuses the cached DMatrix objects.
+    int datasetId_ = 0;
+    int splitId_ = 0;
+    QString selectionKey_;
+    QString dataKey(const QString& part) const;
+    void releaseCachedSplit();
+
     QComboBox *taskBox_, *targetBox_, *stabilizerBox_;
     QTableWidget *featureTable_;
     QLineEdit *iterEdit_, *depthEdit_, *etaEdit_, *lambdaEdit_;
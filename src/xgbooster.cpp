@@ -1,5 +1,15 @@
 #include "xgbooster.hpp"
 #include <QDebug>
+#include <QMutexLocker>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <thread>
+#include <vector>
 
 static void safe_xgboost(int call) {
     if (call != 0) {
@@ -7,11 +17,61 @@ static void safe_xgboost(int call) {
     }
 }
 
+// Number of chunks ParallelFor splits n items into; at least grain items per chunk.
+static size_t ParallelChunks(size_t n, size_t grain) {
+    size_t hw = std::max(1u, std::thread::hardware_concurrency());
+    return std::max<size_t>(1, std::min(hw, n / grain));
+}
+
+// Calls fn(chunk, begin, end) for ParallelChunks(n, grain) contiguous ranges,
+// each on its own thread. All started threads are joined before an exception
+// from fn or from thread creation is rethrown.
+template <typename Fn>
+static void ParallelFor(size_t n, size_t grain, Fn fn) {
+    size_t chunks = ParallelChunks(n, grain);
+    if (chunks == 1) {
+        fn(size_t(0), size_t(0), n);
+        return;
+    }
+    size_t step = (n + chunks - 1) / chunks;
+    std::vector<std::exception_ptr> errors(chunks);
+    std::vector<std::thread> workers;
+    workers.reserve(chunks);
+
+    auto run = [&fn, &errors](size_t c, size_t begin, size_t end) {
+        try {
+            fn(c, begin, end);
+        } catch (...) {
+            errors[c] = std::current_exception();
+        }
+    };
+    auto join = [&workers]() {
+        for (auto& w : workers)
+            if (w.joinable())
+                w.join();
+    };
+
+    try {
+        for (size_t c = 0; c < chunks; ++c) {
+            size_t begin = std::min(n, c * step);
+            size_t end = std::min(n, begin + step);
+            workers.emplace_back(run, c, begin, end);
+        }
+    } catch (...) {
+        join();
+        throw;
+    }
+    join();
+
+    for (const auto& error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
 XGBModel::XGBModel(const QMap<QString, QString>& params, QObject* parent)
     : QObject(parent), params_(params) {}
 
 XGBModel::~XGBModel() {
-    if (dtrain_) XGDMatrixFree(dtrain_);
     if (booster_) XGBoosterFree(booster_);
 }
 
@@ -20,18 +80,89 @@ void XGBModel::CreateDMatrix(const QVector<QVector<double>>& X, DMatrixHandle& d
     if (n_rows == 0)
         throw std::invalid_argument("Empty feature matrix");
 
-    n_features_ = X[0].size();
+    const int n_cols = X[0].size();
 
     QVector<float> flat_X;
-    flat_X.reserve(n_rows * n_features_);
+    flat_X.reserve(n_rows * n_cols);
     for (const auto& row : X) {
-        if (row.size() != n_features_)
+        if (row.size() != n_cols)
             throw std::invalid_argument("Inconsistent feature size");
         for (double val : row)
             flat_X.append(static_cast<float>(val));
     }
 
-    safe_xgboost(XGDMatrixCreateFromMat(flat_X.data(), n_rows, n_features_, -1, &dmat));
+    safe_xgboost(XGDMatrixCreateFromMat(flat_X.data(), n_rows, n_cols, -1, &dmat));
+}
+
+DMatrixPtr XGBModel::AcquireDMatrix(const QVector<QVector<double>>& X, const QString& key,
+                                    std::shared_ptr<QMutex>* fitMutex) {
+    if (X.isEmpty())
+        throw std::invalid_argument("Empty feature matrix");
+    return DMatrixCache::instance().Acquire(key, X.size(), X[0].size(), [this, &X]() {
+        DMatrixHandle dmat = nullptr;
+        CreateDMatrix(X, dmat);
+        return dmat;
+    }, fitMutex);
+}
+
+// Predict must not change the model width that PredictOne relies on
+void XGBModel::CheckFeatureCount(const QVector<QVector<double>>& X) const {
+    if (!booster_)
+        throw std::logic_error("Model is not trained");
+    if (!X.isEmpty() && X[0].size() != n_features_)
+        throw std::invalid_argument("Feature count does not match the model");
+}
+
+void XGBModel::CreateBooster() {
+    if (booster_) {
+        XGBoosterFree(booster_);
+        booster_ = nullptr;
+    }
+    DMatrixHandle dmats[] = { dtrain_.get() };
+    safe_xgboost(XGBoosterCreate(dmats, 1, &booster_));
+}
+
+namespace {
+
+// Per-thread state for PredictOne: a proxy DMatrix and a buffer for the
+// array interface of the row. Both are created once per thread and reused.
+struct SingleRowState {
+    DMatrixPtr proxy;
+    char array_interface[256];
+
+    SingleRowState() {
+        DMatrixHandle handle = nullptr;
+        safe_xgboost(XGProxyDMatrixCreate(&handle));
+        proxy = MakeDMatrixPtr(handle);
+    }
+};
+
+const char kSingleRowConfig[] =
+    "{\"type\": 0, \"training\": false, \"iteration_begin\": 0, "
+    "\"iteration_end\": 0, \"strict_shape\": false, \"missing\": -1}";
+
+} // namespace
+
+const float* XGBModel::PredictRaw(const float* row, bst_ulong* out_len) const {
+    if (!booster_)
+        throw std::logic_error("Model is not trained");
+
+    thread_local SingleRowState state;
+    std::snprintf(state.array_interface, sizeof(state.array_interface),
+                  "{\"data\": [%llu, true], \"shape\": [1, %d], \"strides\": null, "
+                  "\"typestr\": \"<f4\", \"version\": 3}",
+                  static_cast<unsigned long long>(reinterpret_cast<std::uintptr_t>(row)),
+                  n_features_);
+
+    const bst_ulong* out_shape = nullptr;
+    bst_ulong out_dim = 0;
+    const float* out_result = nullptr;
+    safe_xgboost(XGBoosterPredictFromDense(booster_, state.array_interface, kSingleRowConfig,
+                                           state.proxy.get(), &out_shape, &out_dim, &out_result));
+    *out_len = 1;
+    for (bst_ulong i = 0; i < out_dim; ++i)
+        *out_len *= out_shape[i];
+    return out_result;
 }
 
 void XGBModel::SetBoosterParams() {
@@ -40,13 +171,36 @@ void XGBModel::SetBoosterParams() {
     }
 }
 
+void XGBModel::SetPredictThreads(int n) {
+    predictThreads_ = n;
+    ApplyPredictThreads();
+}
+
+void XGBModel::ApplyPredictThreads() {
+    if (booster_ && predictThreads_ > 0)
+        safe_xgboost(XGBoosterSetParam(booster_, "nthread", QByteArray::number(predictThreads_).constData()));
+}
+
 void XGBModel::SaveModel(const QString& filename) {
     safe_xgboost(XGBoosterSaveModel(booster_, filename.toUtf8().constData()));
 }
 
 void XGBModel::LoadModel(const QString& filename) {
+    if (booster_) {
+        XGBoosterFree(booster_);
+        booster_ = nullptr;
+    }
     safe_xgboost(XGBoosterCreate(nullptr, 0, &booster_));
     safe_xgboost(XGBoosterLoadModel(booster_, filename.toUtf8().constData()));
+
+    // nthread is not stored in the model file
+    if (params_.contains("nthread"))
+        safe_xgboost(XGBoosterSetParam(booster_, "nthread", params_["nthread"].toUtf8().constData()));
+    ApplyPredictThreads();
+
+    bst_ulong n_features = 0;
+    safe_xgboost(XGBoosterGetNumFeature(booster_, &n_features));
+    n_features_ = static_cast<int>(n_features);
 }
 
 // ---------------------- XGBRegressor ----------------------
@@ -59,16 +213,23 @@ XGBRegressor::XGBRegressor(const QMap<QString, QString>& params, QObject* parent
 void XGBRegressor::Fit(const QVector<QVector<double>>& X,
                        const QVector<double>& y,
                        float startProgressValue,
-                       float endProgressValue) {
-    CreateDMatrix(X, dtrain_);
+                       float endProgressValue,
+                       const QString& cacheKey) {
+    // Labels live in the shared matrix: hold its fit mutex until training ends
+    std::shared_ptr<QMutex> fitMutex;
+    dtrain_ = AcquireDMatrix(X, cacheKey, &fitMutex);
+    QMutexLocker fitLock(fitMutex.get());
+    n_features_ = X[0].size();
 
     QVector<float> y_f;
     y_f.reserve(y.size());
     for (double v : y)
         y_f.append(static_cast<float>(v));
 
-    safe_xgboost(XGDMatrixSetFloatInfo(dtrain_, "label", y_f.data(), y.size()));
-    safe_xgboost(XGBoosterCreate(&dtrain_, 1, &booster_));
+    safe_xgboost(XGDMatrixSetFloatInfo(dtrain_.get(), "label", y_f.data(), y.size()));
+    // The matrix may come from the cache with weights of a previous Fit
+    safe_xgboost(XGDMatrixSetFloatInfo(dtrain_.get(), "weight", nullptr, 0));
+    CreateBooster();
     SetBoosterParams();
 
     int n_iter = params_.contains("num_boost_round")
@@ -80,80 +241,122 @@ void XGBRegressor::Fit(const QVector<QVector<double>>& X,
     for (int i = 0; i < n_iter; ++i) {
         if (terminated_) {
             qWarning("Training was terminated by user.");
-            return;
+            break;
         }
-        safe_xgboost(XGBoosterUpdateOneIter(booster_, i, dtrain_));
+        safe_xgboost(XGBoosterUpdateOneIter(booster_, i, dtrain_.get()));
         emit progress(startProgressValue + progressWidth * float(i + 1) / n_iter);
     }
+    ApplyPredictThreads();
 }
 
 
-QVector<double> XGBRegressor::Predict(const QVector<QVector<double>>& X) {
-    DMatrixHandle dtest = nullptr;
-    CreateDMatrix(X, dtest);
+QVector<double> XGBRegressor::Predict(const QVector<QVector<double>>& X,
+                                      const QString& cacheKey) {
+    CheckFeatureCount(X);
+    DMatrixPtr dtest = AcquireDMatrix(X, cacheKey);
 
     bst_ulong out_len = 0;
     const float* out_result = nullptr;
 
-    safe_xgboost(XGBoosterPredict(booster_, dtest, 0, 0, 0, &out_len, &out_result));
+    safe_xgboost(XGBoosterPredict(booster_, dtest.get(), 0, 0, 0, &out_len, &out_result));
 
     QVector<double> result;
     result.reserve(out_len);
     for (bst_ulong i = 0; i < out_len; ++i)
         result.append(static_cast<double>(out_result[i]));
 
-    safe_xgboost(XGDMatrixFree(dtest));
     return result;
 }
 
+void XGBRegressor::PredictOne(const float* row, double* out) const {
+    bst_ulong out_len = 0;
+    *out = static_cast<double>(PredictRaw(row, &out_len)[0]);
+}
+
 
 // ---------------------- XGBClassifier ----------------------
 
 XGBClassifier::XGBClassifier(const QMap<QString, QString>& params, QObject* parent)
     : XGBModel(params, parent) {
-    params_["objective"] = "multi:softmax";
+    params_["objective"] = "multi:softprob";
 }
 
+static const size_t kLabelGrain = 1 << 16;
+
 QVector<float> XGBClassifier::EncodeLabels(const QVector<double>& y) {
-    label_to_index_.clear();
+    const size_t n = y.size();
+
+    // Each shard collects the sorted unique labels of its slice; the class count
+    // is small, so a binary search per row beats hashing every label.
+    std::vector<std::vector<double>> shard_labels(ParallelChunks(n, kLabelGrain));
+    std::vector<char> shard_nan(shard_labels.size(), 0);
+    ParallelFor(n, kLabelGrain, [&](size_t shard, size_t begin, size_t end) {
+        std::vector<double>& seen = shard_labels[shard];
+        for (size_t i = begin; i < end; ++i) {
+            double label = y[int(i)];
+            if (std::isnan(label)) {
+                shard_nan[shard] = 1;
+                continue;
+            }
+            auto it = std::lower_bound(seen.begin(), seen.end(), label);
+            if (it == seen.end() || *it != label)
+                seen.insert(it, label);
+        }
+    });
+    if (std::find(shard_nan.begin(), shard_nan.end(), 1) != shard_nan.end())
+        throw std::invalid_argument("NaN class label");
+
+    std::vector<double> labels;
+    for (const auto& seen : shard_labels)
+        labels.insert(labels.end(), seen.begin(), seen.end());
+    std::sort(labels.begin(), labels.end());
+    labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
     index_to_label_.clear();
-    QVector<float> encoded;
-    encoded.reserve(y.size());
-
-    int idx = 0;
-    for (double label : y) {
-        if (!label_to_index_.contains(label)) {
-            label_to_index_[label] = idx++;
-            index_to_label_.append(label);
+    index_to_label_.reserve(int(labels.size()));
+    for (double label : labels)
+        index_to_label_.append(label);
+
+    QVector<float> encoded(int(n));
+    float* out = encoded.data();
+    ParallelFor(n, kLabelGrain, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            auto it = std::lower_bound(labels.begin(), labels.end(), y[int(i)]);
+            out[i] = float(it - labels.begin());
         }
-        encoded.append(label_to_index_[label]);
-    }
+    });
     return encoded;
 }
 
 QVector<double> XGBClassifier::DecodeLabels(const QVector<float>& pred) {
     QVector<double> decoded;
     decoded.reserve(pred.size());
-    for (float val : pred) {
-        int idx = static_cast<int>(val + 0.5);
-        if (idx >= 0 && idx < index_to_label_.size()) {
-            decoded.append(index_to_label_[idx]);
-        } else {
-            decoded.append(-999); // or throw
-        }
-    }
+    for (float val : pred)
+        decoded.append(DecodeLabel(val));
     return decoded;
 }
 
+double XGBClassifier::DecodeLabel(float pred) const {
+    int idx = static_cast<int>(pred + 0.5);
+    if (idx >= 0 && idx < index_to_label_.size())
+        return index_to_label_[idx];
+    return -999; // or throw
+}
+
 void XGBClassifier::Fit(const QVector<QVector<double>>& X,
                         const QVector<double>& y,
                         const QVector<float>& stabilizer,
                         float startProgressValue,
-                        float endProgressValue) {
+                        float endProgressValue,
+                        const QString& cacheKey) {
     QVector<float> y_encoded = EncodeLabels(y);
-    CreateDMatrix(X, dtrain_);
 
-    safe_xgboost(XGDMatrixSetFloatInfo(dtrain_, "label", y_encoded.data(), y_encoded.size()));
+    // Labels and weights live in the shared matrix: hold its fit mutex until training ends
+    std::shared_ptr<QMutex> fitMutex;
+    dtrain_ = AcquireDMatrix(X, cacheKey, &fitMutex);
+    QMutexLocker fitLock(fitMutex.get());
+    n_features_ = X[0].size();
+
+    safe_xgboost(XGDMatrixSetFloatInfo(dtrain_.get(), "label", y_encoded.data(), y_encoded.size()));
 
     if (!stabilizer.isEmpty() && stabilizer.size() == y_encoded.size()) {
         QVector<float> sample_weights(y_encoded.size(), 1.0f);
@@ -167,10 +370,13 @@ void XGBClassifier::Fit(const QVector<QVector<double>>& X,
         float mean_weight = total_weight / sample_weights.size();
         for (float& w : sample_weights) w /= mean_weight;
 
-        safe_xgboost(XGDMatrixSetFloatInfo(dtrain_, "weight", sample_weights.data(), sample_weights.size()));
+        safe_xgboost(XGDMatrixSetFloatInfo(dtrain_.get(), "weight", sample_weights.data(), sample_weights.size()));
+    } else {
+        // The matrix may come from the cache with weights of a previous Fit
+        safe_xgboost(XGDMatrixSetFloatInfo(dtrain_.get(), "weight", nullptr, 0));
     }
 
-    safe_xgboost(XGBoosterCreate(&dtrain_, 1, &booster_));
+    CreateBooster();
 
     int num_class = index_to_label_.size();
     params_["num_class"] = QString::number(num_class);
@@ -185,37 +391,161 @@ void XGBClassifier::Fit(const QVector<QVector<double>>& X,
     for (int i = 0; i < n_iter; ++i) {
         if (terminated_) {
             qWarning("Training was terminated by user.");
-            return;
+            break;
         }
-        safe_xgboost(XGBoosterUpdateOneIter(booster_, i, dtrain_));
+        safe_xgboost(XGBoosterUpdateOneIter(booster_, i, dtrain_.get()));
         emit progress(startProgressValue + progressWidth * float(i + 1) / n_iter);
     }
+    ApplyPredictThreads();
 }
 
 void XGBClassifier::Fit(const QVector<QVector<double>>& X,
                         const QVector<double>& y,
                         float startProgressValue,
-                        float endProgressValue) {
+                        float endProgressValue,
+                        const QString& cacheKey) {
     QVector<float> empty_stabilizer;
-    Fit(X, y, empty_stabilizer, startProgressValue, endProgressValue);
+    Fit(X, y, empty_stabilizer, startProgressValue, endProgressValue, cacheKey);
 }
 
 
 
-QVector<double> XGBClassifier::Predict(const QVector<QVector<double>>& X) {
-    DMatrixHandle dtest;
-    CreateDMatrix(X, dtest);
+// Single pass over a block of softprob rows: optionally copies the
+// probabilities out, and finds the argmax and the top_k classes of each row.
+static void ScanProbaRows(const float* src, size_t begin, size_t end, int n_classes,
+                          const QVector<double>& classes, float* proba,
+                          double* labels, int top_k, double* top_labels) {
+    std::vector<int> top(top_k);
+    for (size_t r = begin; r < end; ++r) {
+        const float* p = src + r * n_classes;
+        if (proba)
+            std::copy(p, p + n_classes, proba + r * n_classes);
+
+        int best = 0;
+        int filled = 0;
+        for (int c = 0; c < n_classes; ++c) {
+            if (p[c] > p[best])
+                best = c;
+            if (top_k > 0 && (filled < top_k || p[c] > p[top[filled - 1]])) {
+                int pos = filled < top_k ? filled++ : top_k - 1;
+                while (pos > 0 && p[top[pos - 1]] < p[c]) {
+                    top[pos] = top[pos - 1];
+                    --pos;
+                }
+                top[pos] = c;
+            }
+        }
+        if (labels)
+            labels[r] = classes[best];
+        for (int k = 0; k < top_k; ++k)
+            top_labels[r * top_k + k] = classes[top[k]];
+    }
+}
+
+static const size_t kProbaGrain = 1 << 12;
+
+QVector<double> XGBClassifier::Predict(const QVector<QVector<double>>& X,
+                                       const QString& cacheKey) {
+    CheckFeatureCount(X);
+    DMatrixPtr dtest = AcquireDMatrix(X, cacheKey);
 
     bst_ulong out_len;
     const float* out_result;
-    safe_xgboost(XGBoosterPredict(booster_, dtest, 0, 0, 0, &out_len, &out_result));
+    safe_xgboost(XGBoosterPredict(booster_, dtest.get(), 0, 0, 0, &out_len, &out_result));
+
+    const size_t n_rows = X.size();
+    if (out_len == n_rows && n_classes() > 1) {
+        // Model trained with multi:softmax: output is already the class index
+        QVector<float> raw;
+        raw.reserve(out_len);
+        for (bst_ulong i = 0; i < out_len; ++i)
+            raw.append(out_result[i]);
+        return DecodeLabels(raw);
+    }
+    if (out_len != n_rows * n_classes())
+        throw std::runtime_error("Unexpected prediction size");
+
+    QVector<double> result(int(n_rows));
+    double* labels = result.data();
+    ParallelFor(n_rows, kProbaGrain, [&](size_t, size_t begin, size_t end) {
+        ScanProbaRows(out_result, begin, end, n_classes(), index_to_label_,
+                      nullptr, labels, 0, nullptr);
+    });
+    return result;
+}
 
-    QVector<float> raw;
-    raw.reserve(out_len);
-    for (bst_ulong i = 0; i < out_len; ++i)
-        raw.append(out_result[i]);
+void XGBClassifier::PredictProba(const QVector<QVector<double>>& X,
+                                 float* proba,
+                                 double* labels,
+                                 int top_k,
+                                 double* top_labels,
+                                 const QString& cacheKey) {
+    const int n_class = n_classes();
+    if (top_labels && (top_k < 0 || top_k > n_class))
+        throw std::invalid_argument("top_k must be in [0, n_classes()]");
+    if (!top_labels)
+        top_k = 0;
+
+    CheckFeatureCount(X);
+    DMatrixPtr dtest = AcquireDMatrix(X, cacheKey);
 
-    QVector<double> result = DecodeLabels(raw);
-    XGDMatrixFree(dtest);
-    return result;
+    bst_ulong out_len;
+    const float* out_result;
+    safe_xgboost(XGBoosterPredict(booster_, dtest.get(), 0, 0, 0, &out_len, &out_result));
+
+    const size_t n_rows = X.size();
+    if (out_len != n_rows * n_class)
+        throw std::invalid_argument("Model does not output class probabilities (multi:softprob)");
+
+    ParallelFor(n_rows, kProbaGrain, [&](size_t, size_t begin, size_t end) {
+        ScanProbaRows(out_result, begin, end, n_class, index_to_label_,
+                      proba, labels, top_k, top_labels);
+    });
+}
+
+void XGBClassifier::PredictOne(const float* row, double* out) const {
+    bst_ulong out_len = 0;
+    const float* p = PredictRaw(row, &out_len);
+    if (out_len == 1 && n_classes() > 1) {
+        *out = DecodeLabel(p[0]);  // multi:softmax model
+        return;
+    }
+    *out = DecodeLabel(float(std::max_element(p, p + out_len) - p));
+}
+
+void XGBClassifier::SaveModel(const QString& filename) {
+    QStringList labels;
+    for (double label : index_to_label_)
+        labels << QString::number(label, 'g', 17);
+    safe_xgboost(XGBoosterSetAttr(booster_, "class_labels", labels.join(',').toUtf8().constData()));
+    XGBModel::SaveModel(filename);
+}
+
+void XGBClassifier::LoadModel(const QString& filename) {
+    XGBModel::LoadModel(filename);
+
+    const char* value = nullptr;
+    int success = 0;
+    safe_xgboost(XGBoosterGetAttr(booster_, "class_labels", &value, &success));
+    index_to_label_.clear();
+    if (!success) {
+        // Saved before labels were persisted: the original labels are lost, so
+        // predictions are reported as class indices 0..num_class-1.
+        bst_ulong len = 0;
+        const char* config = nullptr;
+        safe_xgboost(XGBoosterSaveJsonConfig(booster_, &len, &config));
+        QJsonObject root = QJsonDocument::fromJson(QByteArray(config, int(len))).object();
+        int num_class = root["learner"].toObject()["learner_model_param"].toObject()
+                            ["num_class"].toString().toInt();
+        if (num_class < 2)
+            throw std::runtime_error("Model is not a multiclass classifier (num_class is missing)");
+        qWarning("Model has no stored class labels, predicting class indices.");
+        for (int i = 0; i < num_class; ++i)
+            index_to_label_.append(i);
+        return;
+    }
+    for (const QString& label : QString::fromUtf8(value).split(',')) {
+        if (!label.isEmpty())
+            index_to_label_.append(label.toDouble());
+    }
 }
@@ -1,11 +1,11 @@
 #pragma once
 
 #include <xgboost/c_api.h>
+#include "dmatrixcache.hpp"
 #include <QObject>
 #include <QVector>
 #include <QString>
 #include <QMap>
-#include <QHash>
 #include <stdexcept>
 
 class XGBModel : public QObject {
@@ -14,16 +14,35 @@ public:
     XGBModel(const QMap<QString, QString>& params, QObject* parent = nullptr);
     virtual ~XGBModel();
 
+    // cacheKey selects a DMatrixCache entry for X (empty key disables caching).
+    // It must identify the dataset, the feature selection and the rows of X.
     virtual void Fit(const QVector<QVector<double>>& X,
                  const QVector<double>& y,                
                  float startProgressValue = 0.0f,
-                 float endProgressValue = 1.0f) = 0;
+                 float endProgressValue = 1.0f,
+                 const QString& cacheKey = QString()) = 0;
 
 
-    virtual QVector<double> Predict(const QVector<QVector<double>>& X) = 0;
+    virtual QVector<double> Predict(const QVector<QVector<double>>& X,
+                                    const QString& cacheKey = QString()) = 0;
 
-    void SaveModel(const QString& filename);
-    void LoadModel(const QString& filename);
+    // Low-latency scoring of a single row of n_features() floats (missing value is -1,
+    // as in Predict). Uses in-place prediction with per-thread proxy state, so it does
+    // not allocate in steady state and may be called concurrently from many threads.
+    // Call SetPredictThreads(1) before scoring from concurrent callers: otherwise every
+    // call enters an OpenMP parallel region and tail latency grows with the caller count.
+    virtual void PredictOne(const float* row, double* out) const = 0;
+
+    // Thread count XGBoost uses for prediction (0 keeps the training setting).
+    // Applied now and again after every Fit / LoadModel; not thread-safe with
+    // concurrent predictions.
+    void SetPredictThreads(int n);
+
+    // Set by Fit and LoadModel only; Predict checks its input against it
+    int n_features() const { return n_features_; }
+
+    virtual void SaveModel(const QString& filename);
+    virtual void LoadModel(const QString& filename);
 
     void setTerminated(bool flag) { terminated_ = flag; }
     bool isTerminated() const { return terminated_; }
@@ -33,13 +52,20 @@ signals:
 
 protected:
     BoosterHandle booster_ = nullptr;
-    DMatrixHandle dtrain_ = nullptr;
+    DMatrixPtr dtrain_;
     QMap<QString, QString> params_;
     int n_features_ = 0;
+    int predictThreads_ = 0;
     bool terminated_ = false;
 
     void CreateDMatrix(const QVector<QVector<double>>& X, DMatrixHandle& dmat);
+    DMatrixPtr AcquireDMatrix(const QVector<QVector<double>>& X, const QString& key,
+                              std::shared_ptr<QMutex>* fitMutex = nullptr);
+    void CheckFeatureCount(const QVector<QVector<double>>& X) const;
+    void CreateBooster();
+    const float* PredictRaw(const float* row, bst_ulong* out_len) const;
     void SetBoosterParams();
+    void ApplyPredictThreads();
 };
 
 class XGBRegressor : public XGBModel {
@@ -48,8 +74,11 @@ public:
     void Fit(const QVector<QVector<double>>& X,
          const QVector<double>& y,       
          float startProgressValue = 0.0f,
-         float endProgressValue = 1.0f) override;
-    QVector<double> Predict(const QVector<QVector<double>>& X) override;
+         float endProgressValue = 1.0f,
+         const QString& cacheKey = QString()) override;
+    QVector<double> Predict(const QVector<QVector<double>>& X,
+                            const QString& cacheKey = QString()) override;
+    void PredictOne(const float* row, double* out) const override;
 };
 
 class XGBClassifier : public XGBModel {
@@ -59,19 +88,43 @@ public:
     void Fit(const QVector<QVector<double>>& X,
              const QVector<double>& y,
              float startProgressValue = 0.0f,
-             float endProgressValue = 1.0f) override;
+             float endProgressValue = 1.0f,
+             const QString& cacheKey = QString()) override;
 
     // Добавляем новую версию с stabilizer как отдельную функцию (не override)
     void Fit(const QVector<QVector<double>>& X,
              const QVector<double>& y,
              const QVector<float>& stabilizer,
              float startProgressValue = 0.0f,
-             float endProgressValue = 1.0f);
-    QVector<double> Predict(const QVector<QVector<double>>& X) override;
+             float endProgressValue = 1.0f,
+             const QString& cacheKey = QString());
+    QVector<double> Predict(const QVector<QVector<double>>& X,
+                            const QString& cacheKey = QString()) override;
+    // Writes the decoded class label
+    void PredictOne(const float* row, double* out) const override;
+
+    // One multi:softprob prediction pass for X. proba receives rows x n_classes()
+    // probabilities; optional labels receives the argmax label per row and
+    // optional top_labels receives rows x top_k labels by descending probability
+    // (top_k > n_classes() throws std::invalid_argument).
+    // All buffers are preallocated by the caller.
+    void PredictProba(const QVector<QVector<double>>& X,
+                      float* proba,
+                      double* labels = nullptr,
+                      int top_k = 0,
+                      double* top_labels = nullptr,
+                      const QString& cacheKey = QString());
+
+    int n_classes() const { return index_to_label_.size(); }
+    const QVector<double>& classes() const { return index_to_label_; }
+
+    // Class labels are stored as a booster attribute next to the trees
+    void SaveModel(const QString& filename) override;
+    void LoadModel(const QString& filename) override;
 
 private:
-    QHash<double, int> label_to_index_;
-    QVector<double> index_to_label_;
+    QVector<double> index_to_label_;  // sorted unique labels
     QVector<float> EncodeLabels(const QVector<double>& y);
     QVector<double> DecodeLabels(const QVector<float>& pred);
+    double DecodeLabel(float pred) const;
 };
@@ -4,11 +4,13 @@ CONFIG += c++17
 SOURCES += \
     src/main.cpp \
     src/xgbooster.cpp \
+    src/dmatrixcache.cpp \
     src/mainwindow.cpp
 
 HEADERS += \
     include/xgboost/c_api.h \
     src/xgbooster.hpp \
+    src/dmatrixcache.hpp \
     src/mainwindow.hpp
 
 INCLUDEPATH += include